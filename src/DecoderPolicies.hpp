@@ -0,0 +1,85 @@
+#ifndef DECODERPOLICIES_H
+#define DECODERPOLICIES_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <mutex>
+#include <utility>
+#include "MessageQueue.hpp"
+#include "ProtocolMesg.hpp"
+
+// Policy types for BasicStreamDecoder. Each policy is a small class with a
+// fixed interface; the decoder calls it directly, so picking a no-op policy
+// compiles the feature out instead of branching on it at runtime.
+//
+// Policies are plain classes rather than virtual interfaces on purpose.
+// Everything is resolved at compile time, so the compiler can inline straight
+// through parseByte.
+
+// Logging: a static, printf-style print().
+class PrintfLog {
+    public:
+        __attribute__((format(printf, 1, 2)))
+        static void print(const char* format, ...) {
+            va_list args;
+            va_start(args, format);
+            vprintf(format, args);
+            va_end(args);
+        }
+};
+
+// Drops every log line. Useful for embedded builds without a console.
+class NullLog {
+    public:
+        __attribute__((format(printf, 1, 2)))
+        static void print(const char*, ...) {}
+};
+
+// Locking: an object with lock() and unlock(), held for the duration of each
+// public decoder call. It's taken once per call, so it needn't be recursive.
+class NoLock {
+    public:
+        void lock() {}
+        void unlock() {}
+};
+
+// For decoders shared between a reader thread and consumer threads.
+class MutexLock {
+    public:
+        void lock() {
+            this->mutex.lock();
+        }
+        void unlock() {
+            this->mutex.unlock();
+        }
+
+    protected:
+        std::mutex mutex;
+};
+
+// Allocation: creates and destroys messages. Messages handed out by
+// popNextMessage() must be released through the same policy.
+class NewAllocator {
+    public:
+        template<class T, class... Args>
+        static T* create(Args&&... args) {
+            return new T(std::forward<Args>(args)...);
+        }
+        static void destroy(ProtocolMesg* message) {
+            delete message;
+        }
+};
+
+// Delivery: hands a freshly decoded message to the decoder's message queue.
+// The default queues it for popNextMessage(); other policies could forward it
+// elsewhere. A policy that does queue must push_back, so the queue stays in
+// arrival order - TTL expiry and popOldestMessage() rely on the oldest
+// message being first.
+class QueueDelivery {
+    public:
+        void deliver(MessageQueue& messages, ProtocolMesg* message) {
+            messages.push_back(message);
+        }
+};
+
+#endif
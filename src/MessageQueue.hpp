@@ -0,0 +1,166 @@
+#ifndef MESSAGEQUEUE_H
+#define MESSAGEQUEUE_H
+
+#include <stddef.h>
+#include "ProtocolMesg.hpp"
+
+// An intrusive queue of messages, oldest first. Each message carries its own
+// links (see ProtocolMesg), which thread it onto two lists at once: every
+// queued message in arrival order, and the messages of its own device type
+// in arrival order. That makes these O(1), with no allocation:
+// Add a message to the end -> push_back
+// Remove a message from anywhere -> erase
+// Find the oldest message from any device -> front
+// Find the oldest message of a device type -> frontOfType
+//
+// The queue doesn't own its messages - the decoder creates and destroys them.
+class MessageQueue {
+    public:
+        MessageQueue() {
+            this->clear();
+        }
+
+        // Forget every message. The messages themselves aren't freed.
+        void clear() {
+            this->head = NULL;
+            this->tail = NULL;
+            for (int i = 0; i < TYPE_SLOTS; i++) {
+                this->typeHead[i] = NULL;
+                this->typeTail[i] = NULL;
+            }
+            this->count = 0;
+        }
+
+        bool empty() const {
+            return this->head == NULL;
+        }
+
+        size_t size() const {
+            return this->count;
+        }
+
+        ProtocolMesg* front() const {
+            return this->head;
+        }
+
+        ProtocolMesg* back() const {
+            return this->tail;
+        }
+
+        // The oldest queued message of a device type, or NULL if there's none.
+        ProtocolMesg* frontOfType(ProtocolMesg::deviceType_e devType) const {
+            int slot = typeSlot(devType);
+            return slot < 0 ? NULL : this->typeHead[slot];
+        }
+
+        // Add a message to the end of both its lists.
+        void push_back(ProtocolMesg* message) {
+            message->queuePrev = this->tail;
+            message->queueNext = NULL;
+            if (this->tail != NULL) {
+                this->tail->queueNext = message;
+            } else {
+                this->head = message;
+            }
+            this->tail = message;
+
+            message->typePrev = NULL;
+            message->typeNext = NULL;
+            int slot = typeSlot(message->deviceType);
+            if (slot >= 0) {
+                message->typePrev = this->typeTail[slot];
+                if (this->typeTail[slot] != NULL) {
+                    this->typeTail[slot]->typeNext = message;
+                } else {
+                    this->typeHead[slot] = message;
+                }
+                this->typeTail[slot] = message;
+            }
+            this->count++;
+        }
+
+        // Unlink a queued message from both its lists.
+        void erase(ProtocolMesg* message) {
+            if (message->queuePrev != NULL) {
+                message->queuePrev->queueNext = message->queueNext;
+            } else {
+                this->head = message->queueNext;
+            }
+            if (message->queueNext != NULL) {
+                message->queueNext->queuePrev = message->queuePrev;
+            } else {
+                this->tail = message->queuePrev;
+            }
+
+            int slot = typeSlot(message->deviceType);
+            if (slot >= 0) {
+                if (message->typePrev != NULL) {
+                    message->typePrev->typeNext = message->typeNext;
+                } else {
+                    this->typeHead[slot] = message->typeNext;
+                }
+                if (message->typeNext != NULL) {
+                    message->typeNext->typePrev = message->typePrev;
+                } else {
+                    this->typeTail[slot] = message->typePrev;
+                }
+            }
+
+            message->queuePrev = message->queueNext = NULL;
+            message->typePrev = message->typeNext = NULL;
+            this->count--;
+        }
+
+        // Walks the queue in arrival order, so range-for loops work.
+        // Don't erase the current message mid-loop; its links are cleared.
+        class iterator {
+            public:
+                iterator(ProtocolMesg* node) {
+                    this->node = node;
+                }
+                ProtocolMesg* operator*() const {
+                    return this->node;
+                }
+                iterator& operator++() {
+                    this->node = this->node->queueNext;
+                    return *this;
+                }
+                bool operator!=(const iterator& other) const {
+                    return this->node != other.node;
+                }
+
+            protected:
+                ProtocolMesg* node;
+        };
+
+        iterator begin() const {
+            return iterator(this->head);
+        }
+
+        iterator end() const {
+            return iterator(NULL);
+        }
+
+    protected:
+        // One list per device type. There are only three, so a fixed array
+        // indexed by typeSlot() beats any kind of map.
+        static const int TYPE_SLOTS = 3;
+
+        // Slot for a device type, or -1 if it's not one we know.
+        static int typeSlot(ProtocolMesg::deviceType_e devType) {
+            switch (devType) {
+                case ProtocolMesg::BLIP:   return 0;
+                case ProtocolMesg::WIDGET: return 1;
+                case ProtocolMesg::LATCH:  return 2;
+                default:                   return -1;
+            }
+        }
+
+        ProtocolMesg* head;
+        ProtocolMesg* tail;
+        ProtocolMesg* typeHead[TYPE_SLOTS];
+        ProtocolMesg* typeTail[TYPE_SLOTS];
+        size_t count;
+};
+
+#endif
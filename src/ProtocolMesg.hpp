@@ -1,6 +1,8 @@
 #ifndef PROTOCOLMESG_H
 #define PROTOCOLMESG_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
 
 class ProtocolMesg {
@@ -26,12 +28,27 @@ class ProtocolMesg {
         deviceType_e deviceType;
         uint8_t sequence;
         uint8_t messageType;
+        // Monotonic time (nanoseconds) when the frame finished decoding.
+        // Set by StreamDecoder; only meaningful within one process.
+        uint64_t timestamp;
+
+        // Intrusive links used by MessageQueue while the message is queued:
+        // neighbours in arrival order, and neighbours of the same device type.
+        ProtocolMesg* queuePrev;
+        ProtocolMesg* queueNext;
+        ProtocolMesg* typePrev;
+        ProtocolMesg* typeNext;
 
         ProtocolMesg(uint16_t id, deviceType_e devType, uint8_t sequence, uint8_t msgType) {
             this->deviceId    = id;
             this->deviceType  = devType;
             this->sequence    = sequence;
             this->messageType = msgType;
+            this->timestamp   = 0;
+            this->queuePrev   = NULL;
+            this->queueNext   = NULL;
+            this->typePrev    = NULL;
+            this->typeNext    = NULL;
         }
 };
 
@@ -2,20 +2,37 @@
 #define STREAMDECODER_H
 
 #include <stdint.h>
-#include <list>
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
 #include <vector>
+#include "DecoderPolicies.hpp"
+#include "MessageQueue.hpp"
 #include "ProtocolMesg.hpp"
 
-class StreamDecoder {
+// The decoder is a template over policy types (see DecoderPolicies.hpp):
+// Log     - where INFO/WARNING/ERROR lines go
+// Lock    - guards each public call
+// Alloc   - creates and destroys messages
+// Delivery - hands decoded messages to the message queue
+// StreamDecoder (below) is the default configuration; other builds can pick
+// e.g. NullLog or MutexLock without paying for the ones they don't use.
+template<class Log      = PrintfLog,
+         class Lock     = NoLock,
+         class Alloc    = NewAllocator,
+         class Delivery = QueueDelivery>
+class BasicStreamDecoder {
   public:
-     StreamDecoder() {
+     BasicStreamDecoder() {
+         this->timeToLive = 0;
+         this->expiredCount = 0;
          this->reset();
      }
-     ~StreamDecoder() {
-         // Free anything that was allocated with `new`
-         for (auto it : this->messages) {
-             delete it;
-         }
+     ~BasicStreamDecoder() {
+         // Free anything the allocator handed out
+         this->resetLocked();
      }
 
      // Clears any state in the StreamDecoder. Useful for recovery if
@@ -38,8 +55,9 @@ class StreamDecoder {
         // flexibility to inline/optimize the loop for performance.
         // It also forces a copy of onDataFromChip into each generated
         // object file (duplication of generated code)
+        std::lock_guard<Lock> guard(this->lock);
         for (int i=0; i<size; i++) {
-           parseByte(data[i]);
+           parseByteLocked(data[i]);
         }
      }
 
@@ -59,15 +77,95 @@ class StreamDecoder {
      // Get the next message (in sequence order) from internal storage.
      // The actual class returned will depend on the deviceId - see
      // ProtocolMesg for details on fields for each message type.
+     // Release the message with Alloc::destroy (plain `delete` for the
+     // default allocator).
      ProtocolMesg* popNextMessage(uint16_t deviceId);
 
+     // Check whether any device has an unread message.
+     // Return:
+     // `true` if there's a message ready, `false` otherwise.
+     bool hasAnyMessage();
+
+     // Check whether any device of a given type has an unread message.
+     // Argument:
+     // deviceType_e devType: The device type to query for messages
+     // Return:
+     // `true` if there's a message ready, `false` otherwise.
+     bool hasMessageOfType(ProtocolMesg::deviceType_e devType);
+
+     // Get the oldest message from any device, in the order messages
+     // arrived. This lets one consumer drain all traffic without knowing
+     // device IDs. Arrival order isn't sequence order - use popNextMessage()
+     // where a device's sequence matters.
+     // Return:
+     // The message, or NULL if nothing is queued.
+     ProtocolMesg* popOldestMessage();
+
+     // Same as popOldestMessage(), but only for devices of a given type
+     // (e.g. every Latch message).
+     // Argument:
+     // deviceType_e devType: The device type to pop a message for
+     // Return:
+     // The message, or NULL if no device of that type has one queued.
+     ProtocolMesg* popOldestMessageOfType(ProtocolMesg::deviceType_e devType);
+
+     // Write the full decoder state (partial frame, expectedBytes, and every
+     // queued message) to a compact binary file, so a restarted reader can
+     // pick up where this one left off.
+     // Argument:
+     // const char* path: File to write. An existing file is replaced.
+     // Return:
+     // `true` if the snapshot was written, `false` otherwise.
+     bool saveSnapshot(const char* path);
+
+     // Replace the decoder state with a snapshot written by saveSnapshot().
+     // On failure (missing, truncated or corrupt file) the decoder is left
+     // exactly as it was.
+     // Argument:
+     // const char* path: File to read.
+     // Return:
+     // `true` if the snapshot was restored, `false` otherwise.
+     bool loadSnapshot(const char* path);
+
+     // Drop queued messages older than `ttl` nanoseconds. Expiry is lazy:
+     // stale messages are discarded when the has/pop calls come across
+     // them, so there's no timer or background sweep.
+     // Argument:
+     // uint64_t ttl: Maximum age in nanoseconds, or 0 to keep messages forever.
+     void setTimeToLive(uint64_t ttl) {
+         std::lock_guard<Lock> guard(this->lock);
+         this->timeToLive = ttl;
+     }
+
+     // Number of messages discarded by the TTL since construction.
+     uint32_t expiredMessages() {
+         std::lock_guard<Lock> guard(this->lock);
+         return this->expiredCount;
+     }
+
+     // Latency histogram buckets. Bucket `n` counts messages that waited
+     // between 2^n and 2^(n+1) microseconds from decode to pop; bucket 0
+     // also holds anything under a microsecond.
+     static const int LATENCY_BUCKETS = 32;
+
+     // Number of popped messages of a device type that landed in a
+     // latency bucket.
+     uint32_t latencyCount(ProtocolMesg::deviceType_e devType, int bucket);
+
    protected:
-     // Messages is a list of recieved messages.
-     // A list is nice since we never need to access elements by index.
+     // Messages is a queue of recieved messages, in arrival order.
+     // It's intrusive (see MessageQueue.hpp), so on top of the whole-queue
+     // order it keeps each device type's messages linked together.
      // Add a message to the end -> push O(1)
      // Find the most recent message for a device -> iterate O(n)
-     // Remove that message -> pop O(1)
-     std::list<ProtocolMesg*> messages;
+     // Find the oldest message from any device -> front O(1)
+     // Find the oldest message of a device type -> frontOfType O(1)
+     // Remove that message -> erase O(1)
+     MessageQueue messages;
+
+     // Policy instances. The stateless defaults take no space worth noting.
+     Lock lock;
+     Delivery delivery;
 
      // Buffer of bytes that aren't yet processed into a message.
      std::vector<uint8_t> buffer;
@@ -81,6 +179,59 @@ class StreamDecoder {
 
      // Returns true if newSequence is lower than savedSequence, after unwrapping logic.
      bool betterSequenceNumber(uint8_t savedSequence, uint8_t newSequence);
+
+     // Maximum message age in nanoseconds (0 = no expiry) and a running
+     // count of messages it has discarded.
+     uint64_t timeToLive;
+     uint32_t expiredCount;
+
+     // Decode-to-pop latency histograms, one per device type.
+     std::map<ProtocolMesg::deviceType_e, std::array<uint32_t, LATENCY_BUCKETS>> latency;
+
+     // Unlocked versions of the public calls above. The public methods take
+     // the lock once and then only call these, so Lock needn't be recursive.
+     void resetLocked();
+     void clearBufferLocked();
+     void parseByteLocked(uint8_t data);
+
+     // Monotonic clock in nanoseconds, used for message timestamps.
+     static uint64_t monotonicNow() {
+         return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+     }
+
+     // Returns true if the TTL is set and `message` has outlived it.
+     bool isExpired(ProtocolMesg* message, uint64_t now) {
+         return this->timeToLive != 0 && now - message->timestamp > this->timeToLive;
+     }
+
+     // Discard every queued message that has outlived the TTL.
+     void dropExpired(uint64_t now);
+
+     // Remove a message from the queue, record its latency, and return it.
+     ProtocolMesg* takeMessage(ProtocolMesg* message, uint64_t now);
+
+     // Add a popped message's decode-to-pop latency to its histogram.
+     void recordLatency(ProtocolMesg* message, uint64_t now);
+
+     // Snapshot file header. The version is bumped whenever the layout changes,
+     // so an old file is rejected rather than misread.
+     static const uint32_t SNAPSHOT_MAGIC   = 0x53444543; // "SDEC"
+     static const uint8_t  SNAPSHOT_VERSION = 1;
+
+     // expectedBytes for a partial frame, or -1 if its device type is unknown.
+     static int expectedBytesFor(const std::vector<uint8_t>& partial);
+
+     // Snapshot helpers. Multi-byte fields are packed big-endian, same as the wire.
+     static void putBytes(std::vector<uint8_t>& out, uint32_t value, int width);
+     static bool getBytes(const std::vector<uint8_t>& in, size_t& pos, uint32_t& value, int width);
 };
 
+#include "StreamDecoderImpl.hpp"
+
+// The default decoder: printf logging, no locking, new/delete, queued delivery.
+// It's compiled once in StreamDecoder.cpp rather than in every file that uses it.
+typedef BasicStreamDecoder<> StreamDecoder;
+extern template class BasicStreamDecoder<>;
+
 #endif
@@ -0,0 +1,573 @@
+#ifndef STREAMDECODERIMPL_H
+#define STREAMDECODERIMPL_H
+
+// Method definitions for BasicStreamDecoder. They live in a header since
+// every policy combination needs them; StreamDecoder.hpp includes this.
+#include <stdio.h>
+#include <unistd.h>
+#include "StreamDecoder.hpp"
+
+#define DECODER_TEMPLATE template<class Log, class Lock, class Alloc, class Delivery>
+#define DECODER BasicStreamDecoder<Log, Lock, Alloc, Delivery>
+
+// Clears any state in the StreamDecoder. Useful for recovery if
+// extra bytes arrive in the datastream.
+DECODER_TEMPLATE
+void DECODER::reset() {
+    std::lock_guard<Lock> guard(this->lock);
+    this->resetLocked();
+}
+
+DECODER_TEMPLATE
+void DECODER::resetLocked() {
+    // Erase both the recieved-message and processing buffers.
+    // Unlink each message before freeing it - the links live in the message.
+    while (!this->messages.empty()) {
+        ProtocolMesg* message = this->messages.front();
+        this->messages.erase(message);
+        Alloc::destroy(message);
+    }
+    this->clearBufferLocked();
+}
+
+// Clear the partial-message buffer, but leave the recieved-message
+// list alone.
+DECODER_TEMPLATE
+void DECODER::clearBuffer() {
+    std::lock_guard<Lock> guard(this->lock);
+    this->clearBufferLocked();
+}
+
+DECODER_TEMPLATE
+void DECODER::clearBufferLocked() {
+    this->buffer.clear();
+    // Size of a packet with no payload.
+    this->expectedBytes = 2 + 1 + 1 + 1 + 0 + 1;
+}
+
+// Parse a single byte of incoming data.
+DECODER_TEMPLATE
+void DECODER::parseByte(uint8_t data) {
+    std::lock_guard<Lock> guard(this->lock);
+    this->parseByteLocked(data);
+}
+
+// This performs the work for parseByte() and onDataFromChip().
+// BJN: This is a very long function, and it'd be possible to extract each of
+// the if-blocks to separate functions to shrink this.
+DECODER_TEMPLATE
+void DECODER::parseByteLocked(uint8_t data) {
+    // Add new data to the buffer
+    this->buffer.push_back(data);
+
+    if (recievedBytes() == ProtocolMesg::MSG_TYPE+1) {
+        // Compute the payload size and add to expected size
+        // (Need to add one to compensate for zero-based indexing)
+        switch (this->buffer[ProtocolMesg::DEVICE_TYPE]) {
+            case ProtocolMesg::BLIP:
+                // Payload size is unknown, but at least 1B.
+                expectedBytes += 1;
+                break;
+            case ProtocolMesg::WIDGET:
+                // Payload is always 6B.
+                expectedBytes += 6;
+                break;
+            case ProtocolMesg::LATCH:
+                // LATCH has a 1B payload with STATUS; 0 otherwise.
+                if (this->buffer[ProtocolMesg::MSG_TYPE] == LatchMesg::STATUS) {
+                    expectedBytes += 1;
+                }
+                break;
+            default:
+                // BJN: This protocol doesn't allow for graceful recovery since it's
+                // impossible to find breaks between messages. If there's a message
+                // we can't ID, we can't find the payload size. Without that we can't
+                // find the next message.
+                // (In reality, you'd probably wait for a quiet time on the line and
+                // reset all the buffers. In unit-test land, that sort of heuristic
+                // doesn't make much sense.)
+                Log::print("FATAL: Unknown device type\n");
+                return;
+        }
+    }
+
+    if (this->buffer[ProtocolMesg::DEVICE_TYPE] == ProtocolMesg::BLIP
+        && recievedBytes() == BlipMesg::SIZE+1) {
+        // Special case for BLIP message - grab the string size from
+        // the first byte of payload.
+        expectedBytes += this->buffer[BlipMesg::SIZE];
+    }
+
+    if (recievedBytes() == this->expectedBytes) {
+        // Verify checksum and close out
+        uint8_t sum = 0;
+        uint8_t checksum = this->buffer.back();
+        this->buffer.pop_back();
+        Log::print("INFO: Processing");
+        for (auto it : this->buffer) {
+            Log::print(" %02x", it);
+            sum += it;
+        }
+
+        if (sum == checksum) {
+            Log::print("\nINFO:     checksum OK");
+            // Stamp the message as soon as the frame is known good.
+            uint64_t now = monotonicNow();
+            // Compute common fields
+            uint16_t id      = this->buffer[ProtocolMesg::DEVICE_ID_1] << 8
+                | this->buffer[ProtocolMesg::DEVICE_ID_2];
+            ProtocolMesg::deviceType_e devType  =
+                static_cast<ProtocolMesg::deviceType_e>(
+                                                        this->buffer[ProtocolMesg::DEVICE_TYPE]);
+            uint8_t sequence = this->buffer[ProtocolMesg::SEQUENCE];
+            uint8_t msgType  = this->buffer[ProtocolMesg::MSG_TYPE];
+            if (devType == ProtocolMesg::BLIP) {
+                BlipMesg* blip = Alloc::template create<BlipMesg>(id, devType, sequence, msgType,
+                    std::string(reinterpret_cast<const char*>(&this->buffer[BlipMesg::STRING]),
+                    this->buffer[BlipMesg::SIZE]));
+                    blip->timestamp = now;
+                    this->delivery.deliver(this->messages, blip);
+
+                // BJN: This displays the actual payload, but the string could
+                // have escape characters in it, and that'll mess with a terminal.
+                //Log::print(": Blip message %s", blip->payload.c_str());
+                Log::print(": Blip message %ldB", blip->payload.size());
+
+            } else if (devType == ProtocolMesg::WIDGET) {
+                uint16_t serial = this->buffer[WidgetMesg::SERIAL_1] << 8
+                    | this->buffer[WidgetMesg::SERIAL_2];
+                uint8_t batch   = this->buffer[WidgetMesg::BATCH];
+                uint32_t version = this->buffer[WidgetMesg::VERSION_MAJOR] << 16
+                    | this->buffer[WidgetMesg::VERSION_MINOR] << 8
+                    | this->buffer[WidgetMesg::VERSION_PATCH];
+                Log::print(": Widget message %04X batch %02X ver %06X",
+                       serial, batch, version);
+                    WidgetMesg* widget = Alloc::template create<WidgetMesg>(id, devType, sequence, msgType,
+                               serial, batch, version);
+                    widget->timestamp = now;
+                    this->delivery.deliver(this->messages, widget);
+
+            } else if (devType == ProtocolMesg::LATCH) {
+                bool open = false;
+                if (this->buffer[ProtocolMesg::MSG_TYPE] == LatchMesg::STATUS) {
+                    open = this->buffer[LatchMesg::STATE];
+                } else if (this->buffer[ProtocolMesg::MSG_TYPE] == LatchMesg::OPEN) {
+                    open = true;
+                } else if (this->buffer[ProtocolMesg::MSG_TYPE] == LatchMesg::CLOSE) {
+                    open = false;
+                }
+                Log::print(": Latch message %s", open ? "open" : "closed");
+                LatchMesg* latch = Alloc::template create<LatchMesg>(id, devType, sequence, msgType, open);
+                latch->timestamp = now;
+                this->delivery.deliver(this->messages, latch);
+
+            } else {
+                // BJN: See other note about device type.
+                Log::print("FATAL: Unknown device type");
+            }
+        } else {
+            Log::print("\nWARNING: checksum BAD: Expected %02x; found %02x!", sum, checksum);
+        }
+        // Now that the message is this->messages, clear the buffer.
+        Log::print("\n");
+        this->clearBufferLocked();
+    }
+}
+
+// Check whether a particular device has an unread message.
+// Expired messages found along the way are discarded.
+DECODER_TEMPLATE
+bool DECODER::hasMessage(uint16_t deviceId) {
+    std::lock_guard<Lock> guard(this->lock);
+    if (this->timeToLive != 0) {
+        this->dropExpired(monotonicNow());
+    }
+    for (auto it : this->messages) {
+        if (it->deviceId == deviceId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Check whether any device has an unread message.
+DECODER_TEMPLATE
+bool DECODER::hasAnyMessage() {
+    std::lock_guard<Lock> guard(this->lock);
+    if (this->timeToLive != 0) {
+        this->dropExpired(monotonicNow());
+    }
+    return !this->messages.empty();
+}
+
+// Check whether any device of a given type has an unread message.
+DECODER_TEMPLATE
+bool DECODER::hasMessageOfType(ProtocolMesg::deviceType_e devType) {
+    std::lock_guard<Lock> guard(this->lock);
+    if (this->timeToLive != 0) {
+        this->dropExpired(monotonicNow());
+    }
+    return this->messages.frontOfType(devType) != NULL;
+}
+
+// Discard every queued message that has outlived the TTL.
+// Messages are stored in arrival order and stamped as they arrive, so the
+// stale ones are always at the front - stop at the first fresh one.
+DECODER_TEMPLATE
+void DECODER::dropExpired(uint64_t now) {
+    if (this->timeToLive == 0) {
+        return;
+    }
+    while (!this->messages.empty() && this->isExpired(this->messages.front(), now)) {
+        ProtocolMesg* message = this->messages.front();
+        this->messages.erase(message);
+        Alloc::destroy(message);
+        this->expiredCount++;
+    }
+}
+
+// Get the next message (in sequence order) from internal storage.
+DECODER_TEMPLATE
+ProtocolMesg* DECODER::popNextMessage(uint16_t deviceId) {
+    std::lock_guard<Lock> guard(this->lock);
+    // The message links itself into the queue, so holding on to the
+    // ProtocolMesg* is enough to erase it after iteration.
+    uint64_t now = monotonicNow();
+    // Expire first, so bestMessage can't be erased out from under us.
+    this->dropExpired(now);
+    ProtocolMesg* bestMessage = NULL;
+    for (auto it : this->messages) {
+        if (it->deviceId == deviceId) {
+            if (bestMessage == NULL ||
+                this->betterSequenceNumber(bestMessage->sequence, it->sequence)) {
+                bestMessage = it;
+            }
+        }
+    }
+    ProtocolMesg* retVal = NULL;
+    if (bestMessage == NULL) {
+        // If this were in a larger application, there'd be clever ways to handle
+        // errors - logging, a watchdog reset, or something. For PC use I'm using
+        // printf to indicate that something happened, and not trying to handle it.
+        Log::print("ERROR: No message found.\n");
+    } else {
+        retVal = this->takeMessage(bestMessage, now);
+    }
+    return retVal;
+}
+
+// Get the oldest message (in arrival order) from any device.
+DECODER_TEMPLATE
+ProtocolMesg* DECODER::popOldestMessage() {
+    std::lock_guard<Lock> guard(this->lock);
+    uint64_t now = monotonicNow();
+    this->dropExpired(now);
+    if (this->messages.empty()) {
+        Log::print("ERROR: No message found.\n");
+        return NULL;
+    }
+    return this->takeMessage(this->messages.front(), now);
+}
+
+// Get the oldest message (in arrival order) from any device of a given type.
+DECODER_TEMPLATE
+ProtocolMesg* DECODER::popOldestMessageOfType(ProtocolMesg::deviceType_e devType) {
+    std::lock_guard<Lock> guard(this->lock);
+    uint64_t now = monotonicNow();
+    this->dropExpired(now);
+    // Each type's messages are linked in arrival order, so its front is the
+    // one we want.
+    ProtocolMesg* oldest = this->messages.frontOfType(devType);
+    if (oldest == NULL) {
+        Log::print("ERROR: No message found.\n");
+        return NULL;
+    }
+    return this->takeMessage(oldest, now);
+}
+
+// Remove a message from the queue and hand it to the caller.
+DECODER_TEMPLATE
+ProtocolMesg* DECODER::takeMessage(ProtocolMesg* message, uint64_t now) {
+    Log::print("INFO: Found message for %04x with sequence %02x.\n",
+               message->deviceId, message->sequence);
+    this->recordLatency(message, now);
+    this->messages.erase(message);
+    return message;
+}
+
+// Add a popped message's decode-to-pop latency to its histogram.
+DECODER_TEMPLATE
+void DECODER::recordLatency(ProtocolMesg* message, uint64_t now) {
+    uint64_t micros = (now - message->timestamp) / 1000;
+    int bucket = 0;
+    while (micros > 1 && bucket < LATENCY_BUCKETS-1) {
+        micros >>= 1;
+        bucket++;
+    }
+    // operator[] zero-fills the histogram the first time a type shows up.
+    this->latency[message->deviceType][bucket]++;
+}
+
+// Number of popped messages of a device type that landed in a latency bucket.
+DECODER_TEMPLATE
+uint32_t DECODER::latencyCount(ProtocolMesg::deviceType_e devType, int bucket) {
+    std::lock_guard<Lock> guard(this->lock);
+    auto it = this->latency.find(devType);
+    if (it == this->latency.end() || bucket < 0 || bucket >= LATENCY_BUCKETS) {
+        return 0;
+    }
+    return it->second[bucket];
+}
+
+// Returns true if newSequence is lower than savedSequence, after unwrapping logic.
+DECODER_TEMPLATE
+bool DECODER::betterSequenceNumber(uint8_t savedSequence, uint8_t newSequence) {
+    // This handles wraparound - in the special case where the best sequence number
+    // is low (1..50) but there exist high numbers (200..255), the high numbers are
+    // older, due to wraparound. (This will fail if more than 50 messages are left
+    // in the queue, or if sequence numbers jump for some reason.)
+    //
+    const uint8_t WRAPAROUND_LOW  = 50;
+    const uint8_t WRAPAROUND_HIGH = 200;
+
+    if (savedSequence > WRAPAROUND_HIGH && newSequence < WRAPAROUND_LOW) {
+        // If saved is near wrapping and new wrapped recently,
+        // keep the saved one.
+        return false;
+    }
+    if (savedSequence < WRAPAROUND_LOW && newSequence > WRAPAROUND_HIGH) {
+        // If saved wrapped recently and new hasn't wrapped yet, new is older.
+        // Pick that.
+        return true;
+    }
+
+    // Otherwise - just pick the lowest number.
+    return savedSequence > newSequence;
+}
+
+// Snapshot helpers. Multi-byte fields are packed big-endian, same as the wire.
+DECODER_TEMPLATE
+void DECODER::putBytes(std::vector<uint8_t>& out, uint32_t value, int width) {
+    for (int shift = (width-1)*8; shift >= 0; shift -= 8) {
+        out.push_back((value >> shift) & 0xff);
+    }
+}
+
+// Reads `width` bytes at `pos` into `value`. Returns false (and leaves pos
+// alone) if the snapshot is truncated.
+DECODER_TEMPLATE
+bool DECODER::getBytes(const std::vector<uint8_t>& in, size_t& pos, uint32_t& value, int width) {
+    if (pos + width > in.size()) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < width; i++) {
+        value = value << 8 | in[pos++];
+    }
+    return true;
+}
+
+// Write the full decoder state to a compact binary file.
+// The whole snapshot is built in memory under the lock, then the lock is
+// released for the file I/O so decoding doesn't stall behind an fsync.
+// It's written with one fwrite, fsynced, and renamed over the old file, so a
+// crash mid-write leaves the previous snapshot intact instead of a torn one.
+// (The rename itself isn't durable until the directory is synced too, so
+// after a power loss you may get the previous snapshot back - but never a
+// partial one.)
+DECODER_TEMPLATE
+bool DECODER::saveSnapshot(const char* path) {
+    std::vector<uint8_t> out;
+    size_t messageCount;
+    uint16_t partialBytes;
+    {
+        std::lock_guard<Lock> guard(this->lock);
+        messageCount = this->messages.size();
+        partialBytes = recievedBytes();
+        putBytes(out, SNAPSHOT_MAGIC, 4);
+        putBytes(out, SNAPSHOT_VERSION, 1);
+        putBytes(out, this->expectedBytes, 2);
+        putBytes(out, this->buffer.size(), 2);
+        out.insert(out.end(), this->buffer.begin(), this->buffer.end());
+        putBytes(out, messageCount, 4);
+
+        for (auto it : this->messages) {
+            putBytes(out, it->deviceId, 2);
+            putBytes(out, it->deviceType, 1);
+            putBytes(out, it->sequence, 1);
+            putBytes(out, it->messageType, 1);
+            if (it->deviceType == ProtocolMesg::BLIP) {
+                BlipMesg* blip = static_cast<BlipMesg*>(it);
+                putBytes(out, blip->payload.size(), 1);
+                out.insert(out.end(), blip->payload.begin(), blip->payload.end());
+            } else if (it->deviceType == ProtocolMesg::WIDGET) {
+                WidgetMesg* widget = static_cast<WidgetMesg*>(it);
+                putBytes(out, widget->serial, 2);
+                putBytes(out, widget->batch, 1);
+                putBytes(out, widget->version, 3);
+            } else if (it->deviceType == ProtocolMesg::LATCH) {
+                putBytes(out, static_cast<LatchMesg*>(it)->state, 1);
+            }
+        }
+    }
+
+    std::string tmpPath = std::string(path) + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (file == NULL) {
+        Log::print("ERROR: Can't open snapshot %s for writing.\n", tmpPath.c_str());
+        return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmpPath.c_str(), path) != 0) {
+        Log::print("ERROR: Failed to write snapshot %s.\n", path);
+        remove(tmpPath.c_str());
+        return false;
+    }
+    Log::print("INFO: Saved snapshot with %ld messages, %dB partial frame.\n",
+           messageCount, partialBytes);
+    return true;
+}
+
+// Replace the decoder state with a snapshot written by saveSnapshot().
+// The file is read and checked without the lock, into locals; the decoder
+// is only touched once everything has validated.
+DECODER_TEMPLATE
+bool DECODER::loadSnapshot(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        Log::print("ERROR: Can't open snapshot %s.\n", path);
+        return false;
+    }
+    std::vector<uint8_t> in;
+    uint8_t chunk[4096];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        in.insert(in.end(), chunk, chunk + got);
+    }
+    fclose(file);
+
+    size_t pos = 0;
+    uint32_t magic, version, expected, bufferSize, count;
+    if (!getBytes(in, pos, magic, 4) || magic != SNAPSHOT_MAGIC
+        || !getBytes(in, pos, version, 1) || version != SNAPSHOT_VERSION) {
+        Log::print("ERROR: %s is not a version %d snapshot.\n", path, SNAPSHOT_VERSION);
+        return false;
+    }
+    if (!getBytes(in, pos, expected, 2) || !getBytes(in, pos, bufferSize, 2)
+        || pos + bufferSize > in.size()) {
+        Log::print("ERROR: Snapshot %s is truncated.\n", path);
+        return false;
+    }
+    std::vector<uint8_t> partial(in.begin() + pos, in.begin() + pos + bufferSize);
+    pos += bufferSize;
+    // The buffered bytes determine expectedBytes. If the stored value
+    // disagrees, the frame would end at the wrong byte and knock every
+    // frame after it out of step.
+    int rebuilt = expectedBytesFor(partial);
+    if (rebuilt < 0 || static_cast<uint32_t>(rebuilt) != expected || bufferSize >= expected) {
+        Log::print("ERROR: Snapshot %s has an invalid partial frame.\n", path);
+        return false;
+    }
+
+    // Messages are collected here and only delivered once the whole file
+    // checks out, so a corrupt snapshot never hands anything to Delivery.
+    std::vector<ProtocolMesg*> restored;
+    bool ok = getBytes(in, pos, count, 4);
+    for (uint32_t i = 0; ok && i < count; i++) {
+        uint32_t id, devType, sequence, msgType;
+        ok = getBytes(in, pos, id, 2) && getBytes(in, pos, devType, 1)
+            && getBytes(in, pos, sequence, 1) && getBytes(in, pos, msgType, 1);
+        if (!ok) {
+            break;
+        }
+        ProtocolMesg::deviceType_e type = static_cast<ProtocolMesg::deviceType_e>(devType);
+        if (type == ProtocolMesg::BLIP) {
+            uint32_t size;
+            ok = getBytes(in, pos, size, 1) && pos + size <= in.size();
+            if (ok) {
+                restored.push_back(Alloc::template create<BlipMesg>(id, type, sequence, msgType,
+                    std::string(reinterpret_cast<const char*>(in.data() + pos), size)));
+                pos += size;
+            }
+        } else if (type == ProtocolMesg::WIDGET) {
+            uint32_t serial, batch, ver;
+            ok = getBytes(in, pos, serial, 2) && getBytes(in, pos, batch, 1)
+                && getBytes(in, pos, ver, 3);
+            if (ok) {
+                restored.push_back(Alloc::template create<WidgetMesg>(id, type, sequence, msgType,
+                                                      serial, batch, ver));
+            }
+        } else if (type == ProtocolMesg::LATCH) {
+            uint32_t state;
+            ok = getBytes(in, pos, state, 1);
+            if (ok) {
+                restored.push_back(Alloc::template create<LatchMesg>(id, type, sequence, msgType, state));
+            }
+        } else {
+            ok = false;
+        }
+    }
+    // Anything left over means the message count and the data disagree.
+    ok = ok && pos == in.size();
+
+    if (!ok) {
+        Log::print("ERROR: Snapshot %s is corrupt.\n", path);
+        for (auto it : restored) {
+            Alloc::destroy(it);
+        }
+        return false;
+    }
+
+    // Everything checks out - swap the snapshot in.
+    std::lock_guard<Lock> guard(this->lock);
+    this->resetLocked();
+    this->buffer = partial;
+    this->expectedBytes = expected;
+    // Timestamps come from a monotonic clock, which doesn't survive a restart.
+    // Restored messages count as recieved now, and their TTL starts over.
+    // They go through Delivery just like freshly decoded ones.
+    uint64_t now = monotonicNow();
+    for (auto it : restored) {
+        it->timestamp = now;
+        this->delivery.deliver(this->messages, it);
+    }
+    Log::print("INFO: Loaded snapshot with %ld messages, %dB partial frame.\n",
+           restored.size(), recievedBytes());
+    return true;
+}
+
+// Work out expectedBytes for a partial frame, the same way parseByteLocked()
+// builds it up a byte at a time. Returns -1 if the device type is unknown.
+DECODER_TEMPLATE
+int DECODER::expectedBytesFor(const std::vector<uint8_t>& partial) {
+    // Size of a packet with no payload.
+    int expected = 2 + 1 + 1 + 1 + 0 + 1;
+    if (partial.size() <= ProtocolMesg::DEVICE_TYPE) {
+        return expected;
+    }
+    uint8_t devType = partial[ProtocolMesg::DEVICE_TYPE];
+    if (devType != ProtocolMesg::BLIP && devType != ProtocolMesg::WIDGET
+        && devType != ProtocolMesg::LATCH) {
+        return -1;
+    }
+    if (partial.size() >= ProtocolMesg::MSG_TYPE+1) {
+        if (devType == ProtocolMesg::BLIP) {
+            expected += 1;
+        } else if (devType == ProtocolMesg::WIDGET) {
+            expected += 6;
+        } else if (partial[ProtocolMesg::MSG_TYPE] == LatchMesg::STATUS) {
+            expected += 1;
+        }
+    }
+    if (devType == ProtocolMesg::BLIP && partial.size() >= BlipMesg::SIZE+1) {
+        expected += partial[BlipMesg::SIZE];
+    }
+    return expected;
+}
+
+#undef DECODER
+#undef DECODER_TEMPLATE
+
+#endif
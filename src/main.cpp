@@ -1,5 +1,10 @@
 #include <stdio.h>
 #include <assert.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "StreamDecoder.hpp"
 #include "ProtocolMesg.hpp"
 
@@ -308,11 +313,409 @@ void test_4() {
 
 }
 
+void test_5() {
+    // Test 5: Snapshot and restore
+    // Queue a few messages and leave a frame half-recieved, save the decoder,
+    // then restore into a fresh decoder and finish the frame there.
+    test_banner(5, "Snapshot and restore");
+
+    const char* path = "/tmp/streamdecoder_test.snap";
+    StreamDecoder decoder;
+
+    // Fields are:      ID    ID2   dev   seq   type  payload........ checksum
+    uint8_t data_1[] = {0x22, 0x01, 0x0F, 0x00, 0x01, 0xDE, 0xAD, 0x0F, 0x01, 0x01, 0x04, 0xd3,
+                        0x22, 0x02, 0x1F, 0x00, 0x01, 0x01, 0x45,
+                        0x22, 0x03, 0x05, 0x01, 0x01, 0x0c, 'h', 'e', 'l', 'l', 'o', ',', ' ', 'w', 'o', 'r', 'l', 'd', 0xc0,
+                        // First half of a Latch STATUS message
+                        0x22, 0x02, 0x1F};
+    decoder.onDataFromChip(data_1, sizeof(data_1));
+    assert (decoder.saveSnapshot(path) == true);
+
+    StreamDecoder restored;
+    assert (restored.loadSnapshot(path) == true);
+    remove(path);
+
+    // Second half of the Latch message
+    uint8_t data_2[] = {0x01, 0x01, 0x00, 0x45};
+    restored.onDataFromChip(data_2, sizeof(data_2));
+
+    WidgetMesg* widgetMsg = static_cast<WidgetMesg*>(restored.popNextMessage(0x2201));
+    assert (widgetMsg->serial == 0xDEAD);
+    assert (widgetMsg->batch == 0x0F);
+    assert (widgetMsg->version == 0x010104);
+    delete widgetMsg;
+
+    BlipMesg* blipMsg = static_cast<BlipMesg*>(restored.popNextMessage(0x2203));
+    assert (blipMsg->sequence == 1);
+    assert (blipMsg->payload.compare("hello, world") == 0);
+    delete blipMsg;
+
+    LatchMesg* latchMsg = static_cast<LatchMesg*>(restored.popNextMessage(0x2202));
+    assert (latchMsg->sequence == 0);
+    assert (latchMsg->state == true);
+    delete latchMsg;
+    latchMsg = static_cast<LatchMesg*>(restored.popNextMessage(0x2202));
+    assert (latchMsg->sequence == 1);
+    assert (latchMsg->state == false);
+    delete latchMsg;
+    assert (restored.hasMessage(0x2202) == false);
+
+    // A missing snapshot leaves the decoder as it was.
+    restored.onDataFromChip(data_1, sizeof(data_1));
+    assert (restored.loadSnapshot(path) == false);
+    assert (restored.hasMessage(0x2201) == true);
+    assert (restored.hasMessage(0x2203) == true);
+}
+
+void test_6() {
+    // Test 6: Timestamps, latency histograms, and TTL expiry
+    // Messages are stamped when decoded, popping records the wait in a
+    // per-device-type histogram, and a TTL quietly drops stale messages.
+    test_banner(6, "Timestamps and TTL");
+
+    StreamDecoder decoder;
+    uint32_t total;
+
+    // Fields are:      ID    ID2   dev   seq   type  payload........ checksum
+    uint8_t data_1[] = {0x22, 0x02, 0x1F, 0x00, 0x01, 0x01, 0x45,
+                        0x22, 0x02, 0x1F, 0x01, 0x01, 0x00, 0x45};
+    decoder.onDataFromChip(data_1, sizeof(data_1));
+
+    LatchMesg* latchMsg = static_cast<LatchMesg*>(decoder.popNextMessage(0x2202));
+    assert (latchMsg->timestamp != 0);
+    delete latchMsg;
+    latchMsg = static_cast<LatchMesg*>(decoder.popNextMessage(0x2202));
+    delete latchMsg;
+
+    total = 0;
+    for (int i = 0; i < StreamDecoder::LATENCY_BUCKETS; i++) {
+        total += decoder.latencyCount(ProtocolMesg::LATCH, i);
+        assert (decoder.latencyCount(ProtocolMesg::WIDGET, i) == 0);
+    }
+    assert (total == 2);
+
+    // With a 1ms TTL, anything left sitting for 5ms is gone.
+    decoder.setTimeToLive(1000000);
+    decoder.onDataFromChip(data_1, sizeof(data_1));
+    usleep(5000);
+    assert (decoder.hasMessage(0x2202) == false);
+    assert (decoder.expiredMessages() == 2);
+
+    // Fresh messages are still delivered.
+    decoder.setTimeToLive(1000000000);
+    decoder.onDataFromChip(data_1, sizeof(data_1));
+    assert (decoder.hasMessage(0x2202) == true);
+    latchMsg = static_cast<LatchMesg*>(decoder.popNextMessage(0x2202));
+    assert (latchMsg->sequence == 0);
+    delete latchMsg;
+    assert (decoder.expiredMessages() == 2);
+}
+
+// Test policies for test 7. Both keep static counters, so the test can tell
+// whether the decoder really went through them.
+class CountingAllocator {
+    public:
+        static int created;
+        static int destroyed;
+
+        template<class T, class... Args>
+        static T* create(Args&&... args) {
+            created++;
+            return new T(std::forward<Args>(args)...);
+        }
+        static void destroy(ProtocolMesg* message) {
+            destroyed++;
+            delete message;
+        }
+};
+int CountingAllocator::created = 0;
+int CountingAllocator::destroyed = 0;
+
+// Hands messages to an outbox instead of queueing them in the decoder.
+class OutboxDelivery {
+    public:
+        static std::vector<ProtocolMesg*> outbox;
+
+        void deliver(MessageQueue&, ProtocolMesg* message) {
+            outbox.push_back(message);
+        }
+};
+std::vector<ProtocolMesg*> OutboxDelivery::outbox;
+
+void test_7() {
+    // Test 7: Non-default policies
+    // A quiet, thread-safe decoder should behave exactly like the default one.
+    test_banner(7, "Decoder policies");
+
+    BasicStreamDecoder<NullLog, MutexLock> decoder;
+    ProtocolMesg* message;
+
+    // Reusing the out-of-order set from test 4
+    uint8_t data_1[] = {
+     // ID    ID2   dev   seq   type  checksum
+        0x00, 0x01, 0x1F, 0x01, 0x02, 0x23,
+        0x00, 0x01, 0x1F, 0x04, 0x02, 0x26,
+        0x00, 0x01, 0x1F, 0x03, 0x02, 0x25,
+        0x00, 0x01, 0x1F, 0x02, 0x02, 0x24,
+        0x00, 0x01, 0x1F, 0x05, 0x02, 0x27};
+    decoder.onDataFromChip(data_1, sizeof(data_1));
+
+    uint8_t order_1[] = {1, 2, 3, 4, 5};
+    for (uint8_t i=0; i < sizeof(order_1); i++) {
+        assert (decoder.hasMessage(0x0001) == true);
+        message = decoder.popNextMessage(0x0001);
+        assert (message->sequence == order_1[i]);
+        NewAllocator::destroy(message);
+    }
+    assert (decoder.hasMessage(0x0001) == false);
+
+    // Custom allocation and delivery: every message, decoded or restored
+    // from a snapshot, should be created by the allocator and end up in
+    // the outbox rather than the decoder's queue.
+    const char* path = "/tmp/streamdecoder_policy.snap";
+    StreamDecoder queued;
+    uint8_t data_2[] = {0x22, 0x02, 0x1F, 0x00, 0x01, 0x01, 0x45,
+                        0x22, 0x02, 0x1F, 0x01, 0x01, 0x00, 0x45};
+    queued.onDataFromChip(data_2, sizeof(data_2));
+    assert (queued.saveSnapshot(path) == true);
+    {
+        BasicStreamDecoder<NullLog, NoLock, CountingAllocator, OutboxDelivery> outboxDecoder;
+        outboxDecoder.onDataFromChip(data_1, sizeof(data_1));
+        assert (CountingAllocator::created == 5);
+        assert (OutboxDelivery::outbox.size() == 5);
+        assert (outboxDecoder.hasAnyMessage() == false);
+
+        assert (outboxDecoder.loadSnapshot(path) == true);
+        assert (CountingAllocator::created == 7);
+        assert (OutboxDelivery::outbox.size() == 7);
+        assert (OutboxDelivery::outbox[5]->deviceId == 0x2202);
+        assert (OutboxDelivery::outbox[6]->sequence == 1);
+        assert (outboxDecoder.hasAnyMessage() == false);
+    }
+    remove(path);
+    for (auto it : OutboxDelivery::outbox) {
+        CountingAllocator::destroy(it);
+    }
+    OutboxDelivery::outbox.clear();
+    assert (CountingAllocator::destroyed == 7);
+}
+
+void test_8() {
+    // Test 8: Arrival-order and device-type pops
+    // A central consumer can drain every device without knowing IDs,
+    // or pull just one device type.
+    test_banner(8, "Arrival order and type filters");
+
+    StreamDecoder decoder;
+    ProtocolMesg* message;
+
+    // Fields are:      ID    ID2   dev   seq   type  payload........ checksum
+    uint8_t data_1[] = {0x22, 0x02, 0x1F, 0x00, 0x01, 0x01, 0x45,
+                        0x22, 0x01, 0x0F, 0x00, 0x01, 0xDE, 0xAD, 0x0F, 0x01, 0x01, 0x04, 0xd3,
+                        0x22, 0x03, 0x05, 0x00, 0x01, 0x00, 0x2b,
+                        0x22, 0x02, 0x1F, 0x01, 0x01, 0x00, 0x45};
+    decoder.onDataFromChip(data_1, sizeof(data_1));
+
+    // Type filter skips over the Widget and Blip in between.
+    assert (decoder.hasMessageOfType(ProtocolMesg::LATCH) == true);
+    LatchMesg* latchMsg = static_cast<LatchMesg*>(decoder.popOldestMessageOfType(ProtocolMesg::LATCH));
+    assert (latchMsg->sequence == 0);
+    delete latchMsg;
+    latchMsg = static_cast<LatchMesg*>(decoder.popOldestMessageOfType(ProtocolMesg::LATCH));
+    assert (latchMsg->sequence == 1);
+    delete latchMsg;
+    assert (decoder.hasMessageOfType(ProtocolMesg::LATCH) == false);
+    assert (decoder.popOldestMessageOfType(ProtocolMesg::LATCH) == NULL);
+
+    // Whatever's left comes out in arrival order.
+    ProtocolMesg::deviceType_e order_1[] = {ProtocolMesg::WIDGET, ProtocolMesg::BLIP};
+    for (uint8_t i=0; i < sizeof(order_1)/sizeof(order_1[0]); i++) {
+        assert (decoder.hasAnyMessage() == true);
+        message = decoder.popOldestMessage();
+        assert (message->deviceType == order_1[i]);
+        delete message;
+    }
+    assert (decoder.hasAnyMessage() == false);
+    assert (decoder.popOldestMessage() == NULL);
+
+    // The type indexes stay in step with per-device pops and TTL expiry.
+    // Queue Latch, Widget, Blip, Latch again, then take the first Latch
+    // by device ID - the type index must skip it afterwards.
+    decoder.onDataFromChip(data_1, sizeof(data_1));
+    latchMsg = static_cast<LatchMesg*>(decoder.popNextMessage(0x2202));
+    assert (latchMsg->sequence == 0);
+    delete latchMsg;
+    latchMsg = static_cast<LatchMesg*>(decoder.popOldestMessageOfType(ProtocolMesg::LATCH));
+    assert (latchMsg->sequence == 1);
+    delete latchMsg;
+    assert (decoder.hasMessageOfType(ProtocolMesg::LATCH) == false);
+    assert (decoder.hasMessageOfType(ProtocolMesg::WIDGET) == true);
+
+    decoder.setTimeToLive(1000000);
+    usleep(5000);
+    assert (decoder.hasMessageOfType(ProtocolMesg::WIDGET) == false);
+    assert (decoder.hasMessageOfType(ProtocolMesg::BLIP) == false);
+    assert (decoder.popOldestMessageOfType(ProtocolMesg::BLIP) == NULL);
+    assert (decoder.hasAnyMessage() == false);
+
+    // A fresh message after expiry is still found through its index.
+    decoder.setTimeToLive(0);
+    decoder.onDataFromChip(data_1, sizeof(data_1));
+    message = decoder.popOldestMessageOfType(ProtocolMesg::BLIP);
+    assert (message->deviceId == 0x2203);
+    delete message;
+
+    // Taking a message from the middle of its type's list relinks its
+    // neighbours, in both arrival and type order.
+    decoder.reset();
+    uint8_t data_2[] = {0x00, 0x10, 0x1F, 0x00, 0x03, 0x32,
+                        0x00, 0x20, 0x1F, 0x00, 0x03, 0x42,
+                        0x00, 0x30, 0x1F, 0x00, 0x03, 0x52};
+    decoder.onDataFromChip(data_2, sizeof(data_2));
+    message = decoder.popNextMessage(0x0020);
+    assert (message->deviceId == 0x0020);
+    delete message;
+    uint16_t order_2[] = {0x0010, 0x0030};
+    for (uint8_t i=0; i < sizeof(order_2)/sizeof(order_2[0]); i++) {
+        message = decoder.popOldestMessageOfType(ProtocolMesg::LATCH);
+        assert (message->deviceId == order_2[i]);
+        delete message;
+    }
+    assert (decoder.popOldestMessageOfType(ProtocolMesg::LATCH) == NULL);
+    assert (decoder.hasAnyMessage() == false);
+}
+
+// Writes raw bytes to a file, for building hand-made snapshots.
+void write_file(const char* path, const uint8_t* data, size_t size) {
+    FILE* file = fopen(path, "wb");
+    assert (file != NULL);
+    assert (fwrite(data, 1, size, file) == size);
+    fclose(file);
+}
+
+void test_9() {
+    // Test 9: Bad snapshots are rejected
+    // Truncated or inconsistent snapshots must fail to load and leave the
+    // decoder exactly as it was - queued messages and partial frame intact.
+    test_banner(9, "Corrupt snapshots");
+
+    const char* path = "/tmp/streamdecoder_corrupt.snap";
+    StreamDecoder decoder;
+
+    // Fields are:      magic.................  ver   expected..  buffer size  buffer.....................................  count.................
+    // Good: 3B of a Latch frame, nothing queued
+    uint8_t good[]   = {0x53, 0x44, 0x45, 0x43, 0x01, 0x00, 0x06, 0x00, 0x03, 0x22, 0x02, 0x1F,                               0x00, 0x00, 0x00, 0x00};
+    // Buffer as long as the expected frame, so it can never complete
+    uint8_t bad_1[]  = {0x53, 0x44, 0x45, 0x43, 0x01, 0x00, 0x06, 0x00, 0x07, 0x22, 0x02, 0x1F, 0x00, 0x01, 0x01, 0x45, 0x00, 0x00, 0x00, 0x00};
+    // Unknown device type in the buffer
+    uint8_t bad_2[]  = {0x53, 0x44, 0x45, 0x43, 0x01, 0x00, 0x06, 0x00, 0x03, 0x22, 0x02, 0x42,                               0x00, 0x00, 0x00, 0x00};
+    // Expected size larger than any frame
+    uint8_t bad_3[]  = {0x53, 0x44, 0x45, 0x43, 0x01, 0x03, 0xE8, 0x00, 0x03, 0x22, 0x02, 0x1F,                               0x00, 0x00, 0x00, 0x00};
+    // Trailing garbage after the last message
+    uint8_t bad_4[]  = {0x53, 0x44, 0x45, 0x43, 0x01, 0x00, 0x06, 0x00, 0x03, 0x22, 0x02, 0x1F,                               0x00, 0x00, 0x00, 0x00, 0xAA};
+    // Claims one message, but the file ends mid-header
+    uint8_t bad_5[]  = {0x53, 0x44, 0x45, 0x43, 0x01, 0x00, 0x06, 0x00, 0x03, 0x22, 0x02, 0x1F,                               0x00, 0x00, 0x00, 0x01, 0x22, 0x02};
+    // Expected size in range, but not what the buffered bytes add up to
+    uint8_t bad_6[]  = {0x53, 0x44, 0x45, 0x43, 0x01, 0x00, 0x07, 0x00, 0x03, 0x22, 0x02, 0x1F,                               0x00, 0x00, 0x00, 0x00};
+
+    // Fields are:      ID    ID2   dev   seq   type  payload........ checksum
+    uint8_t data_1[] = {0x22, 0x01, 0x0F, 0x00, 0x01, 0xDE, 0xAD, 0x0F, 0x01, 0x01, 0x04, 0xd3};
+    // A Latch STATUS frame, split after the device type
+    uint8_t data_2[] = {0x22, 0x02, 0x1F};
+    uint8_t data_3[] = {0x00, 0x01, 0x01, 0x45};
+
+    write_file(path, good, sizeof(good));
+    assert (decoder.loadSnapshot(path) == true);
+    decoder.onDataFromChip(data_3, sizeof(data_3));
+    assert (decoder.hasMessage(0x2202) == true);
+    delete decoder.popNextMessage(0x2202);
+
+    const uint8_t* bad[]  = {bad_1, bad_2, bad_3, bad_4, bad_5, bad_6, good};
+    size_t badSize[]      = {sizeof(bad_1), sizeof(bad_2), sizeof(bad_3), sizeof(bad_4), sizeof(bad_5),
+                             sizeof(bad_6), sizeof(good) - 1}; // truncated copy of the good one
+    for (uint8_t i=0; i < sizeof(badSize)/sizeof(badSize[0]); i++) {
+        // Queue a Widget message, then start a Latch frame.
+        decoder.onDataFromChip(data_1, sizeof(data_1));
+        decoder.onDataFromChip(data_2, sizeof(data_2));
+
+        write_file(path, bad[i], badSize[i]);
+        assert (decoder.loadSnapshot(path) == false);
+        assert (decoder.hasMessage(0x2201) == true);
+
+        // The rest of the Latch frame lines up with the untouched partial one.
+        decoder.onDataFromChip(data_3, sizeof(data_3));
+        assert (decoder.hasMessage(0x2202) == true);
+        delete decoder.popNextMessage(0x2201);
+        delete decoder.popNextMessage(0x2202);
+        assert (decoder.hasAnyMessage() == false);
+    }
+    remove(path);
+}
+
+void test_10() {
+    // Test 10: Thread safety
+    // Two threads decode while a third drains, through a MutexLock decoder.
+    // Each onDataFromChip() call holds the lock, so the readers' frames never
+    // interleave; without it they'd corrupt each other's partial frame and
+    // messages would go missing. Every message should come out exactly once,
+    // with each reader's messages in the order it sent them.
+    test_banner(10, "Reader and consumer threads");
+
+    BasicStreamDecoder<NullLog, MutexLock> decoder;
+    const uint16_t COUNT = 20000;
+    std::atomic<int> readersDone(0);
+
+    // Reader `base` sends device IDs base, base+1, ... base+COUNT-1.
+    auto reader = [&decoder, &readersDone, COUNT](uint16_t base) {
+        for (uint16_t i = 0; i < COUNT; i++) {
+            uint16_t id = base + i;
+            // Fields are:    ID                ID2          dev   seq   type  checksum
+            uint8_t data[] = {uint8_t(id >> 8), uint8_t(id), 0x1F, 0x00, 0x03, 0x00};
+            data[5] = data[0] + data[1] + data[2] + data[3] + data[4];
+            decoder.onDataFromChip(data, sizeof(data));
+        }
+        readersDone++;
+    };
+    std::thread reader_1(reader, 0x0000);
+    std::thread reader_2(reader, 0x8000);
+
+    uint16_t next_1 = 0x0000;
+    uint16_t next_2 = 0x8000;
+    while (true) {
+        // Check the flag before popping, so nothing decoded after an empty
+        // pop can be missed.
+        bool finished = readersDone == 2;
+        ProtocolMesg* message = decoder.popOldestMessage();
+        if (message == NULL) {
+            if (finished) {
+                break;
+            }
+            continue;
+        }
+        if (message->deviceId < 0x8000) {
+            assert (message->deviceId == next_1++);
+        } else {
+            assert (message->deviceId == next_2++);
+        }
+        delete message;
+    }
+    reader_1.join();
+    reader_2.join();
+    assert (next_1 == 0x0000 + COUNT);
+    assert (next_2 == 0x8000 + COUNT);
+}
+
 int main() {
     printf("Hello, world!\n");
     test_1();
     test_2();
     test_3();
     test_4();
+    test_5();
+    test_6();
+    test_7();
+    test_8();
+    test_9();
+    test_10();
     printf("Goodbye, world! Till next time.\n");
 }